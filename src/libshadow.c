@@ -27,56 +27,169 @@ const GPoint gpoint_null = (GPoint) {.x = 0, .y = 0};
 
 typedef unsigned int uint_t;
 
-#if defined (PBL_RECT)
-static uint_t g_min_x, g_max_x;
-#else
+// Row descriptors, built once from framebuffer for every platform: pixel x of row y is at
+// offset + x of framebuffer data (and of every map laid out as the framebuffer), for
+// min_x <= x <= max_x, clipped to framebuffer bounds. Offset is negative for the top rows of
+// round displays, row data addressing column 0 before framebuffer data.
 typedef struct {
-  uint_t data_delta;
-  uint8_t min_x;
-  uint8_t max_x;
-}GBitmapDataRowDelta;
-static GBitmapDataRowDelta *g_row_info = NULL;
-#endif
+  int32_t offset;
+  uint16_t min_x;
+  uint16_t max_x;
+} ShadowRow;
+static ShadowRow *shadow_rows = NULL;
 
+static inline const ShadowRow *shadow_row (const int y);
 static inline uint_t row_min_x (const uint_t y);
 static inline uint_t row_max_x (const uint_t y);
+static inline bool in_shadow_bounds (const GPoint point, const GRect bounds);
+static inline int pixel_index (const GPoint point, const GPoint translation);
 static inline void set_fb_pixel(uint8_t * const data, const GPoint point, const GPoint translation, const GColor color);
 static inline GColor get_fb_pixel(const uint8_t *data, GPoint point, GPoint translation);
 
-GColor get_light_shadow_color (const GColor c);
-GColor get_light_bright_color (const GColor c);
+#if defined(PBL_COLOR)
+static inline GColor shade_color (const GColor c, const int level);
+static inline int clamp_level (const int level);
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// Objects registry : hot fields, read for every pixel by shadow rendering, are packed apart
+// from cold fields, only used on object creation and release.
 typedef struct {
-  int base_z, inner_z, outer_z;
+  int8_t base_z, inner_z, outer_z;
 } GShadow_Information;
-static GShadow_Information shadow_object_list [GShadowMaxRef];
-static GShadow shadow_object_current = 0;
+static GShadow_Information shadow_object_list [GShadowMaxObjects];
+
+#define NO_OBJECT 0xFF
+static uint8_t shadow_object_generation [GShadowMaxObjects];
+static uint8_t shadow_object_next_free [GShadowMaxObjects];
+static uint8_t shadow_object_free = NO_OBJECT;
+static bool shadow_registry_initialized = false;
+
+static inline bool is_live_object (const GShadow shadow);
+
+// Caller – provided buffer, all state being carved from it when set, else allocated on heap
+#define ARENA_ALIGN 4
+static uint8_t *shadow_arena = NULL;
+static size_t shadow_arena_length, shadow_arena_used;
+static void *shadow_alloc (const size_t size);
+static void shadow_free (void * const data);
 
 static uint8_t *fb_data;
 
-static GBitmap *shadow_bitmap = NULL;
-static uint8_t *shadow_bitmap_data;
+static uint8_t *shadow_bitmap_data = NULL;
+static GRect shadow_bitmap_bounds;
 static size_t shadow_bitmap_size;
 static uint16_t shadow_bitmap_bytes_per_row;
 static GBitmapFormat shadow_bitmap_format;
 
+static ShadowShading shadow_shading = ShadowShadingEdge;
+static bool shadow_antialiased = false;
+
+#if defined(PBL_COLOR)
+static uint8_t *shadow_distance_data = NULL;
+static void compute_distance_transform (const GRect bounds);
+static int distance_shading (const GPoint origin, const GPoint unit, const GRect bounds,
+                             const int base_z, const int inner_z);
+static int dithered_level (const GPoint origin, const int quarters);
+
+static uint8_t *shadow_light_data = NULL;
 
-inline GColor8 gcolor (const GShadow shadow) {
-  return (GColor8) {.argb = (uint8_t) shadow};
+static ShadowCaptureSink shadow_capture_sink = NULL;
+static void *shadow_capture_context;
+static void write_shadow_capture (const GRect bounds, const ShadowLight * const lights, const size_t n);
+#else
+static size_t shadow_plane_size;
+static uint8_t *shadow_scratch_data;
+// id being drawn on scratch plane, GShadowClear erasing the objects map (no id when never live)
+#define NO_SCRATCH_ID ((GShadow) 0xFFFF)
+static GShadow shadow_scratch_id = NO_SCRATCH_ID;
+static void merge_shadow_scratch ();
+#endif
+
+
+// stale handles are drawn as clear, warned once
+static inline bool is_drawable_object (const GShadow shadow) {
+  static bool warned = false;
+  if (is_live_object (shadow)) {
+    return true;
+  }
+  if (shadow != GShadowClear && ! warned) {
+    APP_LOG (APP_LOG_LEVEL_WARNING, "Drawing of a stale shadowing object (%d)", shadow);
+    warned = true;
+  }
+  return false;
+}
+
+#if defined(PBL_COLOR)
+GColor8 gcolor (const GShadow shadow) {
+  return (GColor8) {.argb = is_drawable_object (shadow) ? (uint8_t) shadow : GShadowClear};
+}
+#else
+GColor8 gcolor (GShadow shadow) {
+  if (! is_drawable_object (shadow)) {
+    shadow = GShadowClear;
+  }
+  // objects (or clear) are drawn white on scratch plane, then merged into objects map planes
+  if (shadow != shadow_scratch_id) {
+    merge_shadow_scratch ();
+    shadow_scratch_id = shadow;
+  }
+  return GColorWhite;
+}
+#endif
+
+static inline int8_t z_value (const int z) {
+  if (z < INT8_MIN || z > INT8_MAX) {
+    APP_LOG (APP_LOG_LEVEL_WARNING, "Shadowing object z value out of range (%d), clamped", z);
+    return (z < INT8_MIN) ? INT8_MIN : INT8_MAX;
+  }
+  return z;
+}
+
+static inline bool is_live_object (const GShadow shadow) {
+  const uint_t ref = shadow & GShadowMaxRef;
+  return (shadow & GShadowUnclear) == GShadowUnclear && ref < GShadowMaxObjects &&
+    (shadow >> GShadowGenerationShift) == shadow_object_generation [ref];
 }
 
 GShadow new_shadowing_object (const int base_z, const int inner_z, const int outer_z) {
-  GShadow r = shadow_object_current;
-  shadow_object_list [shadow_object_current] = 
-    (GShadow_Information) { 
-    .base_z  = base_z,
-    .inner_z = inner_z,
-    .outer_z = outer_z};
-  shadow_object_current = (shadow_object_current + 1) % GShadowMaxRef;
+  if (! shadow_registry_initialized) {
+    for (uint_t ref = 0; ref < GShadowMaxObjects; ref++) {
+      shadow_object_next_free [ref] = (ref + 1 < GShadowMaxObjects) ? ref + 1 : NO_OBJECT;
+    }
+    shadow_object_free = 0;
+    shadow_registry_initialized = true;
+  }
 
-  return GShadowUnclear | r;
+  const uint_t ref = shadow_object_free;
+  if (ref == NO_OBJECT) {
+    APP_LOG (APP_LOG_LEVEL_ERROR, "No more shadowing object (%d in use)", GShadowMaxObjects);
+    return GShadowClear;
+  }
+  shadow_object_free = shadow_object_next_free [ref];
+
+  shadow_object_list [ref] =
+    (GShadow_Information) {
+    .base_z  = z_value (base_z),
+    .inner_z = z_value (inner_z),
+    .outer_z = z_value (outer_z)};
+
+  return (GShadow) (shadow_object_generation [ref] << GShadowGenerationShift) | GShadowUnclear | ref;
+}
+
+void release_shadowing_object (const GShadow shadow) {
+  if (! is_live_object (shadow)) {
+    APP_LOG (APP_LOG_LEVEL_WARNING, "Release of a stale shadowing object (%d)", shadow);
+    return;
+  }
+  const uint_t ref = shadow & GShadowMaxRef;
+
+  // pixels of the object left on objects map are neither shaded nor shading
+  shadow_object_list [ref] = (GShadow_Information) {.base_z = 0, .inner_z = 0, .outer_z = 0};
+  shadow_object_generation [ref]++;
+  shadow_object_next_free [ref] = shadow_object_free;
+  shadow_object_free = ref;
 }
 
 void reset_shadow () {
@@ -84,41 +197,56 @@ void reset_shadow () {
 }
 
 void switch_to_shadow_ctx (GContext * const ctx) {
-  Gbitmap * const fb = graphics_capture_frame_buffer(ctx); {
-    if (shadow_bitmap == NULL) {
-      const GRect shadow_bitmap_bounds = gbitmap_get_bounds (fb);
+  GBitmap * const fb = graphics_capture_frame_buffer(ctx); {
+    if (shadow_bitmap_data == NULL) {
+      shadow_bitmap_bounds = gbitmap_get_bounds (fb);
       shadow_bitmap_format = gbitmap_get_format (fb);
       shadow_bitmap_bytes_per_row = gbitmap_get_bytes_per_row (fb);
-      shadow_bitmap_size = shadow_bitmap_bounds.size.h * shadow_bitmap_bounds.size.w;
+      fb_data = gbitmap_get_data (fb);
 
-      shadow_bitmap_data = malloc (shadow_bitmap_size);
-      memset (shadow_bitmap_data, GShadowClear, shadow_bitmap_size);
+      const GRect bounds = shadow_bitmap_bounds;
+      const int bounds_max_x = bounds.origin.x + bounds.size.w - 1;
+      shadow_rows = shadow_alloc (sizeof (ShadowRow) * bounds.size.h);
+      for(uint_t i = 0; i < (uint_t)bounds.size.h; i++) {
+        const GBitmapDataRowInfo info = gbitmap_get_data_row_info(fb, bounds.origin.y + i);
+        shadow_rows [i] = (ShadowRow) {.offset = info.data - fb_data,
+                                       .min_x = (info.min_x > bounds.origin.x) ? info.min_x : bounds.origin.x,
+                                       .max_x = (info.max_x < bounds_max_x) ? info.max_x : bounds_max_x};
+      }
 
-      fb_data = gbitmap_get_data (fb);
+      // maps end with the last row of the framebuffer
+      const ShadowRow last = shadow_rows [bounds.size.h - 1];
+#if defined(PBL_COLOR)
+      shadow_bitmap_size = last.offset + last.max_x + 1;
 
-#if defined(PBL_RECT)
-      g_min_x = 0;
-      g_max_x = shadow_bitmap_bounds.size.w;
+      shadow_bitmap_data = shadow_alloc (shadow_bitmap_size);
+      memset (shadow_bitmap_data, GShadowClear, shadow_bitmap_size);
 #else
-      g_row_info = malloc (sizeof (GBitmapDataRowDelta) * shadow_bitmap_bounds.size.h);
-      for(uint_t y = 0; y < (uint_t)shadow_bitmap_bounds.size.h; y++) {
-        const GBitmapDataRowInfo info = gbitmap_get_data_row_info(fb, y);
-        g_row_info [y] = (GBitmapDataRowDelta){.min_x = info.min_x, .max_x = info.max_x, .data_delta = info.data - fb_data};
-      }
-#endif
+      // objects map planes, followed by the scratch plane
+      shadow_plane_size = last.offset + shadow_bitmap_bytes_per_row;
+      shadow_bitmap_size = GShadowPlanes * shadow_plane_size;
 
-      shadow_bitmap = gbitmap_create_with_data (shadow_bitmap_data);
-      gbitmap_set_data (shadow_bitmap, shadow_bitmap_data, shadow_bitmap_format, shadow_bitmap_bytes_per_row,true);
-      gbitmap_set_bounds (shadow_bitmap, shadow_bitmap_bounds);
+      shadow_bitmap_data = shadow_alloc (shadow_bitmap_size + shadow_plane_size);
+      memset (shadow_bitmap_data, GShadowClear, shadow_bitmap_size + shadow_plane_size);
+      shadow_scratch_data = shadow_bitmap_data + shadow_bitmap_size;
+#endif
     }
 
+#if defined(PBL_COLOR)
     gbitmap_set_data (fb, shadow_bitmap_data, shadow_bitmap_format, shadow_bitmap_bytes_per_row, true);
+#else
+    gbitmap_set_data (fb, shadow_scratch_data, shadow_bitmap_format, shadow_bitmap_bytes_per_row, true);
+#endif
 
   } graphics_release_frame_buffer(ctx, fb);
+  // objects map holds ids, not colors, and must stay aliased (see set_shadow_antialiased)
   graphics_context_set_antialiased (ctx, false);
 }
 
 void revert_to_fb_ctx (GContext * const ctx) {
+#if defined(PBL_BW)
+  merge_shadow_scratch ();
+#endif
   GBitmap *fb = graphics_capture_frame_buffer(ctx); {
     gbitmap_set_data (fb, fb_data, shadow_bitmap_format, shadow_bitmap_bytes_per_row, true);
   } graphics_release_frame_buffer(ctx, fb);
@@ -126,25 +254,254 @@ void revert_to_fb_ctx (GContext * const ctx) {
 }
 
 void destroy_shadow_ctx () {
-#if defined(PBL_ROUND)
-  if (g_row_info) {
-    free (g_row_info);
-    g_row_info = NULL;
-  }
+  shadow_free (shadow_rows);
+  shadow_rows = NULL;
+#if defined(PBL_COLOR)
+  shadow_free (shadow_distance_data);
+  shadow_distance_data = NULL;
+  shadow_free (shadow_light_data);
+  shadow_light_data = NULL;
 #endif
-  gbitmap_destroy (shadow_bitmap);
+  shadow_free (shadow_bitmap_data);
+  shadow_bitmap_data = NULL;
+  // caller buffer may now be released
+  shadow_arena = NULL;
 };
 
-void create_shadow (GContext * const ctx, const int32_t angle) {
-  // compute x and y offset from angle and height (z)
+static inline size_t arena_aligned (const size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~ (size_t) (ARENA_ALIGN - 1);
+}
+
+size_t shadow_buffer_size (const uint32_t features) {
+  const size_t w = PBL_DISPLAY_WIDTH;
+  const size_t h = PBL_DISPLAY_HEIGHT;
+  // slack for the alignment of caller buffer
+  size_t size = ARENA_ALIGN - 1;
+#if defined(PBL_COLOR)
+  // upper bound of maps laid out as the framebuffer (round rows are shorter)
+  const size_t map_size = arena_aligned (w * h);
+  size += map_size;
+  if (features & ShadowFeatureContinuous) size += map_size;
+  if (features & ShadowFeatureMultiLight) size += arena_aligned ((w * h + 1) / 2);
+#else
+  // objects map planes and scratch plane, rows being padded to 32 bits words
+  size += (GShadowPlanes + 1) * h * (((w + 31) / 32) * 4);
+#endif
+  size += arena_aligned (sizeof (ShadowRow) * h);
+  return size;
+}
+
+bool shadow_init_with_buffer (void * const mem, const size_t length, const uint32_t features) {
+  if (shadow_bitmap_data != NULL) {
+    APP_LOG (APP_LOG_LEVEL_ERROR, "Shadow buffer must be given before first shadow context switch");
+    return false;
+  }
+  if (mem == NULL || length < shadow_buffer_size (features)) {
+    APP_LOG (APP_LOG_LEVEL_ERROR, "Shadow buffer too small (%d bytes, %d needed)", (int) length, (int) shadow_buffer_size (features));
+    return false;
+  }
+  const size_t misalignment = (uintptr_t) mem & (ARENA_ALIGN - 1);
+  const size_t skip = misalignment ? ARENA_ALIGN - misalignment : 0;
+  shadow_arena = (uint8_t *) mem + skip;
+  shadow_arena_length = length - skip;
+  shadow_arena_used = 0;
+  return true;
+}
+
+static void *shadow_alloc (const size_t size) {
+  if (shadow_arena) {
+    const size_t aligned = arena_aligned (size);
+    if (shadow_arena_used + aligned <= shadow_arena_length) {
+      void * const data = shadow_arena + shadow_arena_used;
+      shadow_arena_used += aligned;
+      return data;
+    }
+    APP_LOG (APP_LOG_LEVEL_WARNING, "Shadow buffer exhausted, %d bytes allocated on heap", (int) size);
+  }
+  return malloc (size);
+}
+
+static void shadow_free (void * const data) {
+  if (data && ! (shadow_arena && (uint8_t *) data >= shadow_arena && (uint8_t *) data < shadow_arena + shadow_arena_length)) {
+    free (data);
+  }
+}
+
+void set_shadow_shading (const ShadowShading shading) {
+  shadow_shading = shading;
+}
+
+void set_shadow_antialiased (const bool antialiased) {
+  shadow_antialiased = antialiased;
+}
+
+// translations of every object, for every light (about 2 pixels per unit of z), with the step
+// (- 1, 0 or 1 on each axis) toward the pixel covered by half when translation is sub-sampled at 2x
+typedef struct {
+  int16_t x, y;
+  int8_t half_x, half_y;
+} ShadowTranslation;
+static ShadowTranslation shadow_inner_translation [ShadowMaxLights][GShadowMaxObjects];
+static ShadowTranslation shadow_outer_translation [ShadowMaxLights][GShadowMaxObjects];
+
+static inline GPoint translation_point (const ShadowTranslation t) {
+  return (GPoint) {.x = t.x, .y = t.y};
+}
+
+static inline GPoint half_step (const ShadowTranslation t) {
+  return (GPoint) {.x = t.half_x, .y = t.half_y};
+}
+
+static inline ShadowTranslation translation_of (const int offset_x, const int offset_y, const int z) {
+  const int x2 = (offset_x * z * 2) / GShadowMaxValue;
+  const int y2 = (offset_y * z * 2) / GShadowMaxValue;
+  return (ShadowTranslation) {.x = x2 / 2, .y = y2 / 2, .half_x = x2 % 2, .half_y = y2 % 2};
+}
+
+// compute x and y offset from angle and height (z), return translation for a unit height
+static GPoint compute_translations (const uint_t l, const int32_t angle) {
   const int offset_x = (- cos_lookup (angle) * GShadowMaxValue * 2) / TRIG_MAX_RATIO;
   const int offset_y = (sin_lookup (angle) * GShadowMaxValue * 2) / TRIG_MAX_RATIO;
 
+  for (uint_t ref = 0; ref < (uint_t) GShadowMaxObjects; ref++) {
+    const int inner_z = shadow_object_list [ref].inner_z;
+    const int outer_z = shadow_object_list [ref].outer_z;
+    shadow_inner_translation [l][ref] = translation_of (offset_x, offset_y, inner_z);
+    shadow_outer_translation [l][ref] = translation_of (offset_x, offset_y, outer_z);
+  }
+  return (GPoint) {.x = offset_x / GShadowMaxValue, .y = offset_y / GShadowMaxValue};
+}
+
+void create_shadow (GContext * const ctx, const int32_t angle) {
+  const ShadowLight light = {.angle = angle, .strength = 1};
+  create_shadow_multi (ctx, &light, 1);
+}
+
+#if defined(PBL_COLOR)
+
+// Light level map: a signed 4 bits level per pixel, two pixels per byte (pixel of index i of the
+// objects map is in byte i / 2), levels being saturated.
+#define LIGHT_LEVEL_MAX 7
+
+static inline size_t light_map_size (const size_t map_size) {
+  return (map_size + 1) / 2;
+}
+
+static inline int get_light_level (const GPoint origin, const GPoint translation) {
+  const int i = pixel_index (origin, translation);
+  const int nibble = (shadow_light_data [i / 2] >> (4 * (i & 1))) & 0xF;
+  return (nibble ^ 0x8) - 0x8;
+}
+
+static inline void set_light_level (const GPoint origin, const GPoint translation, const int level) {
+  const int i = pixel_index (origin, translation);
+  const uint_t shift = 4 * (i & 1);
+  shadow_light_data [i / 2] = (shadow_light_data [i / 2] & ~ (0xF << shift)) | ((level & 0xF) << shift);
+}
+
+// Shading is either applied directly to the framebuffer (one light), or accumulated as a
+// light level per pixel, then applied once through the color tables.
+static inline void apply_light (const bool accumulate, const GPoint origin, const GPoint translation, const int level) {
+  if (accumulate) {
+    const int sum = get_light_level (origin, translation) + level;
+    set_light_level (origin, translation, (sum < - LIGHT_LEVEL_MAX) ? - LIGHT_LEVEL_MAX : (sum > LIGHT_LEVEL_MAX) ? LIGHT_LEVEL_MAX : sum);
+  } else {
+    set_fb_pixel (fb_data, origin, translation, shade_color (get_fb_pixel (fb_data, origin, translation), clamp_level (level)));
+  }
+}
+
+static void apply_light_levels (const GRect bounds) {
+  for(uint_t y = bounds.origin.y; y < (uint_t)(bounds.origin.y + bounds.size.h); y++) {
+    const uint_t max_x = row_max_x (y);
+    for(uint_t x = row_min_x (y); x <= max_x; x++) {
+      const GPoint origin = (GPoint) {.x = x, .y = y};
+      const int level = get_light_level (origin, gpoint_null);
+      if (level) {
+        set_fb_pixel (fb_data, origin, gpoint_null, shade_color (get_fb_pixel (fb_data, origin, gpoint_null), clamp_level (level)));
+      }
+    }
+  }
+}
+
+// Antialiasing: a pixel covered by half is shaded on one pixel out of two (checkered dither, the
+// palette being too coarse for blending of adjacent levels)
+static inline bool half_covered (const GPoint point) {
+  return (point.x + point.y) & 1;
+}
+
+static inline int base_z_of (const GPoint origin, const GPoint translation) {
+  return shadow_object_list [get_fb_pixel (shadow_bitmap_data, origin, translation).argb & GShadowMaxRef].base_z;
+}
+
+// Pixel next to a self shading band (origin being in the band), covered by half when it is in the
+// middle of the object
+static inline void apply_half_band (const bool accumulate, const GPoint origin, const GPoint step,
+                                    const GPoint translation, const GRect bounds, const int base_z, const int level) {
+  const GPoint point = gpoint_add (origin, step);
+  if (half_covered (point) && in_shadow_bounds (point, bounds) &&
+      in_shadow_bounds (gpoint_add (point, translation), bounds) &&
+      in_shadow_bounds (gpoint_sub (point, translation), bounds) &&
+      base_z_of (point, gpoint_null) == base_z && base_z_of (point, translation) == base_z &&
+      base_z_of (point, gpoint_invert (translation)) == base_z) {
+    apply_light (accumulate, origin, step, level);
+  }
+}
+
+void create_shadow_multi (GContext * const ctx, const ShadowLight * const requested_lights, size_t n) {
+  if (n > ShadowMaxLights) {
+    APP_LOG (APP_LOG_LEVEL_WARNING, "Only %d lights are rendered", ShadowMaxLights);
+    n = ShadowMaxLights;
+  }
+
+  // strengths are bounded once, for rendering and capture alike;
+  // translation for a unit height is used to follow the light direction on distance map
+  ShadowLight lights [ShadowMaxLights];
+  GPoint unit [ShadowMaxLights];
+  for (uint_t l = 0; l < n; l++) {
+    const int strength = requested_lights [l].strength;
+    lights [l] = (ShadowLight) {.angle = requested_lights [l].angle,
+                                .strength = (strength < - LIGHT_LEVEL_MAX) ? - LIGHT_LEVEL_MAX :
+                                            (strength > LIGHT_LEVEL_MAX) ? LIGHT_LEVEL_MAX : strength};
+    unit [l] = compute_translations (l, lights [l].angle);
+  }
+
   GBitmap * const fb = graphics_capture_frame_buffer(ctx);
   {
     // Manipulate the image data...
     const GRect bounds = gbitmap_get_bounds(fb);
-    // Iterate over all rows
+
+    if (shadow_shading == ShadowShadingContinuous) {
+      if (shadow_distance_data == NULL) {
+        shadow_distance_data = shadow_alloc (shadow_bitmap_size);
+      }
+      if (shadow_distance_data == NULL) {
+        APP_LOG (APP_LOG_LEVEL_WARNING, "No memory for distance map, back to edge shading");
+        shadow_shading = ShadowShadingEdge;
+      } else {
+        compute_distance_transform (bounds);
+      }
+    }
+
+    if (shadow_capture_sink) {
+      write_shadow_capture (bounds, lights, n);
+      shadow_capture_sink = NULL;
+    }
+
+    bool accumulate = (n > 1);
+    if (accumulate) {
+      if (shadow_light_data == NULL) {
+        shadow_light_data = shadow_alloc (light_map_size (shadow_bitmap_size));
+      }
+      if (shadow_light_data == NULL) {
+        // lights are then applied one after the other
+        APP_LOG (APP_LOG_LEVEL_WARNING, "No memory for light level map, lights applied directly");
+        accumulate = false;
+      } else {
+        memset (shadow_light_data, 0, light_map_size (shadow_bitmap_size));
+      }
+    }
+
+    // Iterate over all rows, objects information being shared by all lights
 
     for(uint_t y = bounds.origin.y; y < (uint_t)(bounds.origin.y + bounds.size.h); y++) {
       const uint_t max_x = row_max_x (y);
@@ -153,186 +510,596 @@ void create_shadow (GContext * const ctx, const int32_t angle) {
         const GShadow id = (GShadow)get_fb_pixel (shadow_bitmap_data, origin, gpoint_null).argb;
         if (id != GShadowClear) {
           const GShadow ref = id & GShadowMaxRef;
-          const GShadow base_z  = shadow_object_list [ref].base_z;
-          const GShadow inner_z = shadow_object_list [ref].inner_z;
-          const GShadow outer_z = shadow_object_list [ref].outer_z;
-
-          if (inner_z) {
-            const GPoint translation = (GPoint) {.x = (offset_x * inner_z) / GShadowMaxValue,
-                                                 .y = (offset_y * inner_z) / GShadowMaxValue};
-
-            if (gpoint_in_rect (gpoint_add (origin,translation), bounds) &&
-                gpoint_in_rect (gpoint_sub (origin,translation), bounds)) {
-              const int dec_id_plus  = (GShadow) get_fb_pixel (shadow_bitmap_data, origin, translation).argb;
-              const GShadow dec_base_plus  = shadow_object_list [dec_id_plus & GShadowMaxRef].base_z;
-
-              const int dec_id_minus = (GShadow) get_fb_pixel (shadow_bitmap_data, origin, gpoint_invert (translation)).argb;
-              const GShadow dec_base_minus  = shadow_object_list [dec_id_minus & GShadowMaxRef].base_z;
-
-              // we are still on the same object, then shadow apply
-              if (base_z == dec_base_minus && base_z == dec_base_plus) {
-                // we are in the middle of the object
-              } else if (base_z == dec_base_minus && base_z != dec_base_plus) {
-                // we are at the shadow side of the object
-                set_fb_pixel (fb_data, origin, gpoint_null, get_light_shadow_color (get_fb_pixel (fb_data, origin, gpoint_null)));
-
-              } else if (base_z != dec_base_minus && base_z == dec_base_plus) {
-                // we are at the bright side of the object
-                set_fb_pixel (fb_data, origin, gpoint_null, get_light_bright_color (get_fb_pixel (fb_data, origin, gpoint_null)));
-
-              } else {
-                // we are at an edge of the object
+          const int base_z  = shadow_object_list [ref].base_z;
+          const int inner_z = shadow_object_list [ref].inner_z;
+          const int outer_z = shadow_object_list [ref].outer_z;
+
+          for (uint_t l = 0; l < n; l++) {
+            const int strength = lights [l].strength;
+
+            if (inner_z && shadow_shading == ShadowShadingContinuous) {
+              const int level = dithered_level (origin, distance_shading (origin, unit [l], bounds, base_z, inner_z) * strength);
+              if (level) {
+                apply_light (accumulate, origin, gpoint_null, level);
+              }
+            } else if (inner_z) {
+              const GPoint translation = translation_point (shadow_inner_translation [l][ref]);
+
+              if (in_shadow_bounds (gpoint_add (origin,translation), bounds) &&
+                  in_shadow_bounds (gpoint_sub (origin,translation), bounds)) {
+                const int dec_id_plus  = (GShadow) get_fb_pixel (shadow_bitmap_data, origin, translation).argb;
+                const int dec_base_plus  = shadow_object_list [dec_id_plus & GShadowMaxRef].base_z;
+
+                const int dec_id_minus = (GShadow) get_fb_pixel (shadow_bitmap_data, origin, gpoint_invert (translation)).argb;
+                const int dec_base_minus  = shadow_object_list [dec_id_minus & GShadowMaxRef].base_z;
+
+                // we are still on the same object, then shadow apply
+                if (base_z == dec_base_minus && base_z == dec_base_plus) {
+                  // we are in the middle of the object
+                } else if (base_z == dec_base_minus && base_z != dec_base_plus) {
+                  // we are at the shadow side of the object
+                  apply_light (accumulate, origin, gpoint_null, - strength);
+                  if (shadow_antialiased) {
+                    apply_half_band (accumulate, origin, gpoint_invert (half_step (shadow_inner_translation [l][ref])),
+                                     translation, bounds, base_z, - strength);
+                  }
+
+                } else if (base_z != dec_base_minus && base_z == dec_base_plus) {
+                  // we are at the bright side of the object
+                  apply_light (accumulate, origin, gpoint_null, strength);
+                  if (shadow_antialiased) {
+                    apply_half_band (accumulate, origin, half_step (shadow_inner_translation [l][ref]),
+                                     translation, bounds, base_z, strength);
+                  }
+
+                } else {
+                  // we are at an edge of the object
+                }
               }
             }
-          }
 
-          if (outer_z) {
-            const GPoint translation = (GPoint) {.x = (offset_x * outer_z) / GShadowMaxValue, .y = (offset_y * outer_z) / GShadowMaxValue};
-            if (gpoint_in_rect (gpoint_add (origin, translation), bounds)) {
+            if (outer_z) {
+              const GPoint translation = translation_point (shadow_outer_translation [l][ref]);
+              if (in_shadow_bounds (gpoint_add (origin, translation), bounds)) {
+
+                const GShadow dec_id_plus = (GShadow) get_fb_pixel (shadow_bitmap_data, origin, translation).argb;
+                const int dec_z = (dec_id_plus != GShadowClear)? shadow_object_list [dec_id_plus & GShadowMaxRef].outer_z : outer_z;
+                if (id != dec_id_plus && outer_z > dec_z) {
+                  // we are down the object, then shadowing occurs
+                  apply_light (accumulate, origin, translation, - strength);
+                }
+              }
 
-              const GShadow dec_id_plus = (GShadow) get_fb_pixel (shadow_bitmap_data, origin, translation).argb;
-              const int dec_z = (dec_id_plus != GShadowClear)? shadow_object_list [dec_id_plus & GShadowMaxRef].outer_z : outer_z;
-              if (id != dec_id_plus && outer_z > dec_z) {
-                // we are down the object, then shadowing occurs
-                set_fb_pixel (fb_data, origin, translation, get_light_shadow_color (get_fb_pixel (fb_data, origin, translation)));
+              // past the shadow edge, pixel covered by half unless it is shadowed by the next object pixel
+              const GPoint step = half_step (shadow_outer_translation [l][ref]);
+              const GPoint half = gpoint_add (translation, step);
+              if (shadow_antialiased && (step.x || step.y) && half_covered (gpoint_add (origin, half)) &&
+                  in_shadow_bounds (gpoint_add (origin, step), bounds) && in_shadow_bounds (gpoint_add (origin, half), bounds) &&
+                  (GShadow) get_fb_pixel (shadow_bitmap_data, origin, step).argb != id) {
+                const GShadow dec_id_half = (GShadow) get_fb_pixel (shadow_bitmap_data, origin, half).argb;
+                const int dec_z = (dec_id_half != GShadowClear)? shadow_object_list [dec_id_half & GShadowMaxRef].outer_z : outer_z;
+                if (id != dec_id_half && outer_z > dec_z) {
+                  apply_light (accumulate, origin, half, - strength);
+                }
               }
             }
           }
         }
       }
     }
+
+    if (accumulate) {
+      apply_light_levels (bounds);
+    }
   } graphics_release_frame_buffer(ctx, fb);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-static inline uint_t row_min_x (const uint_t y) {
-#if defined (PBL_RECT)
-  // #pragma unused (y)
-  return g_min_x;
-#else
-  return g_row_info [y].min_x;
-#endif
+// Continuous self shading : a two – pass chamfer (3 – 4) distance transform gives, for every
+// object pixel, the distance to the object edge (pixels of another base_z). Shading is then
+// given by the slope of the distance map along the light direction, its intensity by the
+// distance to the edge with respect to shading length.
+
+#define DISTANCE_STRAIGHT 3
+#define DISTANCE_DIAGONAL 4
+#define DISTANCE_MAX      255
+#define DISTANCE_QUARTERS 4
+
+static inline int base_z_at (const GPoint origin, const GPoint translation) {
+  const GShadow id = (GShadow) get_fb_pixel (shadow_bitmap_data, origin, translation).argb;
+  return (id != GShadowClear) ? shadow_object_list [id & GShadowMaxRef].base_z : 0;
 }
-static inline uint_t row_max_x (const uint_t y) {
-#if defined (PBL_RECT)
-  // #pragma unused (y)
-  return g_max_x;
-#else
-  return g_row_info [y].max_x;
-#endif
+
+static inline bool is_object_edge (const GPoint origin, const GRect bounds, const GShadow id, const int base_z) {
+  static const GPoint neighbours [] = {{.x = -1, .y = 0}, {.x = 1, .y = 0}, {.x = 0, .y = -1}, {.x = 0, .y = 1}};
+  for (uint_t i = 0; i < ARRAY_LENGTH (neighbours); i++) {
+    // screen borders are not object edges
+    if (in_shadow_bounds (gpoint_add (origin, neighbours [i]), bounds)) {
+      const GShadow n_id = (GShadow) get_fb_pixel (shadow_bitmap_data, origin, neighbours [i]).argb;
+      if (n_id == GShadowClear || (n_id != id && base_z_at (origin, neighbours [i]) != base_z)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static inline uint_t distance_relax (const uint_t distance, const GPoint origin, const GPoint translation,
+                                     const GRect bounds, const uint_t weight) {
+  if (in_shadow_bounds (gpoint_add (origin, translation), bounds)) {
+    const uint_t d = get_fb_pixel (shadow_distance_data, origin, translation).argb + weight;
+    return (d < distance) ? d : distance;
+  }
+  return distance;
+}
+
+static void compute_distance_transform (const GRect bounds) {
+  const uint_t y_end = bounds.origin.y + bounds.size.h;
+
+  // forward pass, from top left neighbours
+  for (uint_t y = bounds.origin.y; y < y_end; y++) {
+    const uint_t max_x = row_max_x (y);
+    for (uint_t x = row_min_x (y); x <= max_x; x++) {
+      const GPoint origin = (GPoint) {.x = x, .y = y};
+      const GShadow id = (GShadow) get_fb_pixel (shadow_bitmap_data, origin, gpoint_null).argb;
+      uint_t d = 0;
+      if (id != GShadowClear && ! is_object_edge (origin, bounds, id, shadow_object_list [id & GShadowMaxRef].base_z)) {
+        d = DISTANCE_MAX;
+        d = distance_relax (d, origin, (GPoint) {.x = -1, .y =  0}, bounds, DISTANCE_STRAIGHT);
+        d = distance_relax (d, origin, (GPoint) {.x =  0, .y = -1}, bounds, DISTANCE_STRAIGHT);
+        d = distance_relax (d, origin, (GPoint) {.x = -1, .y = -1}, bounds, DISTANCE_DIAGONAL);
+        d = distance_relax (d, origin, (GPoint) {.x =  1, .y = -1}, bounds, DISTANCE_DIAGONAL);
+      }
+      set_fb_pixel (shadow_distance_data, origin, gpoint_null, (GColor) {.argb = d});
+    }
+  }
+
+  // backward pass, from bottom right neighbours
+  for (uint_t y = y_end; y-- > (uint_t) bounds.origin.y;) {
+    const uint_t min_x = row_min_x (y);
+    for (uint_t x = row_max_x (y) + 1; x-- > min_x;) {
+      const GPoint origin = (GPoint) {.x = x, .y = y};
+      uint_t d = get_fb_pixel (shadow_distance_data, origin, gpoint_null).argb;
+      if (d) {
+        d = distance_relax (d, origin, (GPoint) {.x =  1, .y = 0}, bounds, DISTANCE_STRAIGHT);
+        d = distance_relax (d, origin, (GPoint) {.x =  0, .y = 1}, bounds, DISTANCE_STRAIGHT);
+        d = distance_relax (d, origin, (GPoint) {.x =  1, .y = 1}, bounds, DISTANCE_DIAGONAL);
+        d = distance_relax (d, origin, (GPoint) {.x = -1, .y = 1}, bounds, DISTANCE_DIAGONAL);
+        set_fb_pixel (shadow_distance_data, origin, gpoint_null, (GColor) {.argb = d});
+      }
+    }
+  }
+}
+
+static inline int distance_along (const GPoint origin, const GPoint translation, const GRect bounds,
+                                  const int base_z, const int distance) {
+  if (! in_shadow_bounds (gpoint_add (origin, translation), bounds)) {
+    return distance;
+  }
+  if (base_z_at (origin, translation) != base_z) {
+    return 0;
+  }
+  return get_fb_pixel (shadow_distance_data, origin, translation).argb;
+}
+
+static int distance_shading (const GPoint origin, const GPoint unit, const GRect bounds,
+                             const int base_z, const int inner_z) {
+  const int distance = get_fb_pixel (shadow_distance_data, origin, gpoint_null).argb;
+  // shading length is the inner translation length (2 pixels per unit of height)
+  const int length = 2 * DISTANCE_STRAIGHT * ((inner_z > 0) ? inner_z : - inner_z);
+  if (distance >= length) {
+    // we are in the middle of the object
+    return 0;
+  }
+
+  const GPoint step = (inner_z > 0) ? unit : gpoint_invert (unit);
+  const int slope =
+    distance_along (origin, step, bounds, base_z, distance) -
+    distance_along (origin, gpoint_invert (step), bounds, base_z, distance);
+  if (slope == 0) {
+    // we are on a ridge of the object
+    return 0;
+  }
+
+  // one level at the edge, fading toward the middle of the object
+  const int quarters = (DISTANCE_QUARTERS * (length - distance) + length - 1) / length;
+  // distance decreases toward shadow side, and increases toward bright side
+  return (slope < 0) ? - quarters : quarters;
+}
+
+// level of quarters / 4, the remaining quarters being dithered on a 2x2 ordered pattern
+static int dithered_level (const GPoint origin, const int quarters) {
+  static const uint8_t threshold [2][2] = {{0, 2}, {3, 1}};
+  const int magnitude = (quarters < 0) ? - quarters : quarters;
+  const int level = magnitude / DISTANCE_QUARTERS +
+    ((magnitude % DISTANCE_QUARTERS) > threshold [origin.y & 1][origin.x & 1]);
+  return (quarters < 0) ? - level : level;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Capture format (little endian) :
+//  "SHDW", version (u8), width, height, bytes per row (u16), format (u8), shading (u8), antialiased (u8),
+//  data length (u32),
+//  lights count (u8), then per light angle (i32), strength (i8),
+//  objects count (u8), then per object base_z, inner_z, outer_z (i16),
+//  then objects map and framebuffer, each as (run length (u8, 1..255), value (u8)) pairs.
+
+#define CAPTURE_BUFFER_SIZE 64
+typedef struct {
+  uint8_t buffer [CAPTURE_BUFFER_SIZE];
+  size_t length;
+} CaptureWriter;
+
+static inline size_t shadow_data_length () {
+  return shadow_bitmap_size;
+}
+
+static void capture_flush (CaptureWriter * const w) {
+  if (w->length) {
+    shadow_capture_sink (w->buffer, w->length, shadow_capture_context);
+    w->length = 0;
+  }
+}
+
+static void capture_put (CaptureWriter * const w, const uint32_t value, const uint_t bytes) {
+  if (w->length + bytes > CAPTURE_BUFFER_SIZE) {
+    capture_flush (w);
+  }
+  for (uint_t i = 0; i < bytes; i++) {
+    w->buffer [w->length++] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+static void capture_put_rle (CaptureWriter * const w, const uint8_t * const data, const size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    const uint8_t value = data [i];
+    uint_t run = 1;
+    while (run < 255 && i + run < length && data [i + run] == value) {
+      run++;
+    }
+    capture_put (w, run, 1);
+    capture_put (w, value, 1);
+    i += run;
+  }
+}
+
+static void write_shadow_capture (const GRect bounds, const ShadowLight * const lights, const size_t n) {
+  CaptureWriter w = {.length = 0};
+  const size_t length = shadow_data_length ();
+
+  capture_put (&w, 'S' | 'H' << 8 | 'D' << 16 | (uint32_t) 'W' << 24, 4);
+  capture_put (&w, ShadowCaptureVersion, 1);
+  capture_put (&w, bounds.size.w, 2);
+  capture_put (&w, bounds.size.h, 2);
+  capture_put (&w, shadow_bitmap_bytes_per_row, 2);
+  capture_put (&w, shadow_bitmap_format, 1);
+  capture_put (&w, shadow_shading, 1);
+  capture_put (&w, shadow_antialiased, 1);
+  capture_put (&w, length, 4);
+  capture_put (&w, n, 1);
+  for (uint_t l = 0; l < n; l++) {
+    capture_put (&w, (uint32_t) lights [l].angle, 4);
+    capture_put (&w, (uint8_t) lights [l].strength, 1);
+  }
+
+  capture_put (&w, GShadowMaxRef, 1);
+  for (uint_t ref = 0; ref < (uint_t) GShadowMaxRef; ref++) {
+    capture_put (&w, (uint16_t) shadow_object_list [ref].base_z, 2);
+    capture_put (&w, (uint16_t) shadow_object_list [ref].inner_z, 2);
+    capture_put (&w, (uint16_t) shadow_object_list [ref].outer_z, 2);
+  }
+
+  capture_put_rle (&w, shadow_bitmap_data, length);
+  capture_put_rle (&w, fb_data, length);
+  capture_flush (&w);
+}
+
+void capture_next_shadow (ShadowCaptureSink sink, void *context) {
+  shadow_capture_sink = sink;
+  shadow_capture_context = context;
+}
+
+static uint32_t capture_get (const uint8_t ** const p, const uint_t bytes) {
+  uint32_t value = 0;
+  for (uint_t i = 0; i < bytes; i++) {
+    value |= (uint32_t) *(*p)++ << (8 * i);
+  }
+  return value;
+}
+
+static bool capture_get_rle (const uint8_t ** const p, const uint8_t * const end, uint8_t * const data, const size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    if (end - *p < 2) return false;
+    const uint_t run = *(*p)++;
+    const uint8_t value = *(*p)++;
+    if (run == 0 || i + run > length) return false;
+    memset (data + i, value, run);
+    i += run;
+  }
+  return true;
+}
+
+bool replay_shadow_capture (GContext * const ctx, const uint8_t *capture, size_t length) {
+  const uint8_t *p = capture;
+  const uint8_t * const end = capture + length;
+
+  // make sure objects map exists and matches the context framebuffer
+  switch_to_shadow_ctx (ctx);
+  revert_to_fb_ctx (ctx);
+
+  if (length < 19 || capture_get (&p, 4) != ('S' | 'H' << 8 | 'D' << 16 | (uint32_t) 'W' << 24) ||
+      capture_get (&p, 1) != ShadowCaptureVersion) {
+    return false;
+  }
+  const uint_t w = capture_get (&p, 2);
+  const uint_t h = capture_get (&p, 2);
+  const uint_t bytes_per_row = capture_get (&p, 2);
+  const GBitmapFormat format = capture_get (&p, 1);
+  const ShadowShading shading = capture_get (&p, 1);
+  const bool antialiased = capture_get (&p, 1);
+  const size_t data_length = capture_get (&p, 4);
+  if (w != (uint_t) shadow_bitmap_bounds.size.w || h != (uint_t) shadow_bitmap_bounds.size.h ||
+      bytes_per_row != shadow_bitmap_bytes_per_row || format != shadow_bitmap_format ||
+      data_length != shadow_data_length ()) {
+    return false;
+  }
+
+  ShadowLight lights [ShadowMaxLights];
+  const uint_t n = capture_get (&p, 1);
+  if (n > ShadowMaxLights || (size_t) (end - p) < n * 5 + 1) {
+    return false;
+  }
+  for (uint_t l = 0; l < n; l++) {
+    lights [l].angle = (int32_t) capture_get (&p, 4);
+    lights [l].strength = (int8_t) capture_get (&p, 1);
+  }
+
+  const uint_t count = capture_get (&p, 1);
+  if (count > (uint_t) GShadowMaxRef || (size_t) (end - p) < count * 6) {
+    return false;
+  }
+  for (uint_t ref = 0; ref < count; ref++) {
+    shadow_object_list [ref].base_z  = (int16_t) capture_get (&p, 2);
+    shadow_object_list [ref].inner_z = (int16_t) capture_get (&p, 2);
+    shadow_object_list [ref].outer_z = (int16_t) capture_get (&p, 2);
+  }
+
+  if (! capture_get_rle (&p, end, shadow_bitmap_data, data_length) ||
+      ! capture_get_rle (&p, end, fb_data, data_length)) {
+    return false;
+  }
+
+  const ShadowShading previous_shading = shadow_shading;
+  const bool previous_antialiased = shadow_antialiased;
+  shadow_shading = shading;
+  shadow_antialiased = antialiased;
+  create_shadow_multi (ctx, lights, n);
+  shadow_shading = previous_shading;
+  shadow_antialiased = previous_antialiased;
+  return true;
 }
-static inline GColor get_fb_pixel(const uint8_t *data, GPoint point, GPoint translation) {
 
-#if defined (PBL_RECT)
-  const uint_t row_beginning = (point.y + translation.y) * (g_max_x - g_min_x);
-#else
-  const GBitmapDataRowDelta info = g_row_info[point.y + translation.y];
-  const uint_t row_beginning = info.data_delta;
 #endif
 
-#if defined (PBL_RECT)
-  const uint_t row_x = point.x + translation.x;
+////////////////////////////////////////////////////////////////////////////////
+// Black and white platforms : the objects map is bit – sliced on GShadowPlanes 1 – bit planes laid
+// out as the framebuffer, bit b of an object code (ref + 1) being set on plane b. Shade and bright
+// masks are evaluated 32 pixels per word, then applied through an ordered dither pattern.
+#if defined(PBL_BW)
+
+#define WORD_BITS 32
+// set of object codes, bit c for code c
+#if GShadowPlanes <= 3
+typedef uint8_t ShadowCodes;
+#elif GShadowPlanes == 4
+typedef uint16_t ShadowCodes;
+#elif GShadowPlanes == 5
+typedef uint32_t ShadowCodes;
 #else
-  const GBitmapDataRowDelta info_ori = g_row_info[point.y];
-  const uint_t row_x = point.x + translation.x + (info.min_x - info_ori.min_x);
+#error "GShadowPlanes is limited to 5 (31 objects)"
 #endif
 
-  return (GColor) (data [row_beginning + row_x]);
+static const uint32_t shadow_dither [2] = {0x55555555, 0xAAAAAAAA};
+
+static void merge_shadow_scratch () {
+  if (shadow_bitmap_data == NULL || shadow_scratch_id == NO_SCRATCH_ID) {
+    return;
+  }
+  // clear is code 0, clearing every plane
+  const uint_t code = (shadow_scratch_id != GShadowClear) ? (shadow_scratch_id & GShadowMaxRef) + 1 : 0;
+  uint32_t * const scratch = (uint32_t *) shadow_scratch_data;
+  for (uint_t i = 0; i < shadow_plane_size / sizeof (uint32_t); i++) {
+    const uint32_t drawn = scratch [i];
+    if (drawn) {
+      for (uint_t b = 0; b < GShadowPlanes; b++) {
+        uint32_t * const plane = (uint32_t *) (shadow_bitmap_data + b * shadow_plane_size);
+        plane [i] = (code & (1 << b)) ? (plane [i] | drawn) : (plane [i] & ~ drawn);
+      }
+      scratch [i] = 0;
+    }
+  }
 }
 
-static inline void set_fb_pixel(uint8_t * const data, const GPoint point, const GPoint translation, const GColor color) {
+// planes words holding pixels x + dx, for x in word k of row y (zero out of bitmap)
+static inline void fetch_planes (uint32_t planes [GShadowPlanes], const int y, const uint_t k, const int dx,
+                                 const uint_t words, const GRect bounds) {
+  if (y < bounds.origin.y || y >= bounds.origin.y + bounds.size.h) {
+    memset (planes, 0, GShadowPlanes * sizeof (uint32_t));
+    return;
+  }
+  const int offset = (int) (k * WORD_BITS) + dx;
+  const int lo = (offset >= 0) ? offset / WORD_BITS : - ((WORD_BITS - 1 - offset) / WORD_BITS);
+  const uint_t shift = offset - lo * WORD_BITS;
+  for (uint_t b = 0; b < GShadowPlanes; b++) {
+    const uint32_t * const row = (const uint32_t *) (shadow_bitmap_data + b * shadow_plane_size + shadow_row (y)->offset);
+    const uint32_t w0 = (lo >= 0 && (uint_t) lo < words) ? row [lo] : 0;
+    const uint32_t w1 = (lo + 1 >= 0 && (uint_t) lo + 1 < words) ? row [lo + 1] : 0;
+    planes [b] = shift ? ((w0 >> shift) | (w1 << (WORD_BITS - shift))) : w0;
+  }
+}
 
-#if defined (PBL_RECT)
-  const uint_t row_beginning = (point.y + translation.y) * (g_max_x - g_min_x);
-#else
-  const GBitmapDataRowDelta info = g_row_info[point.y + translation.y];
-  const uint_t row_beginning = info.data_delta;
-#endif
+static inline uint32_t codes_mask (const uint32_t planes [GShadowPlanes], const ShadowCodes codes) {
+  uint32_t mask = 0;
+  for (uint_t code = 1; code <= GShadowMaxObjects; code++) {
+    if (codes & ((ShadowCodes) 1 << code)) {
+      uint32_t m = ~ (uint32_t) 0;
+      for (uint_t b = 0; b < GShadowPlanes; b++) {
+        m &= (code & (1 << b)) ? planes [b] : ~ planes [b];
+      }
+      mask |= m;
+    }
+  }
+  return mask;
+}
 
-#if defined (PBL_RECT)
-  const uint_t row_x = point.x + translation.x;
-#else
-  const GBitmapDataRowDelta info_ori = g_row_info[point.y];
-  const uint_t row_x = point.x + translation.x + (info.min_x - info_ori.min_x);
+// pixels lo <= x < hi of word k
+static inline uint32_t column_mask (const uint_t k, const int lo, const int hi) {
+  const int first = k * WORD_BITS;
+  const int a = (lo > first) ? lo - first : 0;
+  const int b = (hi < first + WORD_BITS) ? hi - first : WORD_BITS;
+  if (b <= a) {
+    return 0;
+  }
+  const uint32_t upper = (b == WORD_BITS) ? ~ (uint32_t) 0 : ((uint32_t) 1 << b) - 1;
+  return upper & ~ (((uint32_t) 1 << a) - 1);
+}
+
+void create_shadow_multi (GContext * const ctx, const ShadowLight * const lights, size_t n) {
+  if (n > ShadowMaxLights) {
+    APP_LOG (APP_LOG_LEVEL_WARNING, "Only %d lights are rendered", ShadowMaxLights);
+    n = ShadowMaxLights;
+  }
+  for (uint_t l = 0; l < n; l++) {
+    compute_translations (l, lights [l].angle);
+  }
+
+  // objects on the same base, and objects under each object
+  ShadowCodes same_base [GShadowMaxObjects], under [GShadowMaxObjects];
+  for (uint_t r = 0; r < GShadowMaxObjects; r++) {
+    same_base [r] = under [r] = 0;
+    for (uint_t j = 0; j < GShadowMaxObjects; j++) {
+      if (shadow_object_list [j].base_z == shadow_object_list [r].base_z) same_base [r] |= (ShadowCodes) 1 << (j + 1);
+      if (shadow_object_list [j].outer_z < shadow_object_list [r].outer_z) under [r] |= (ShadowCodes) 1 << (j + 1);
+    }
+  }
+
+  GBitmap * const fb = graphics_capture_frame_buffer(ctx);
+  {
+    const GRect bounds = gbitmap_get_bounds(fb);
+    const int y_end = bounds.origin.y + bounds.size.h;
+    const uint_t words = shadow_bitmap_bytes_per_row / sizeof (uint32_t);
+
+    for (int y = bounds.origin.y; y < y_end; y++) {
+      const ShadowRow * const row = shadow_row (y);
+      uint32_t * const fb_row = (uint32_t *) (fb_data + row->offset);
+      const uint32_t dither = shadow_dither [y & 1];
+
+      for (uint_t k = row->min_x / WORD_BITS; k <= (uint_t) row->max_x / WORD_BITS; k++) {
+        const uint32_t columns = column_mask (k, row->min_x, row->max_x + 1);
+        uint32_t planes [GShadowPlanes], plus [GShadowPlanes], minus [GShadowPlanes];
+        fetch_planes (planes, y, k, 0, words, bounds);
+        uint32_t shade = 0, bright = 0;
+
+        for (uint_t r = 0; r < GShadowMaxObjects; r++) {
+          const int inner_z = shadow_object_list [r].inner_z;
+          const int outer_z = shadow_object_list [r].outer_z;
+          const uint32_t here = codes_mask (planes, (ShadowCodes) 1 << (r + 1));
+
+          for (uint_t l = 0; l < n; l++) {
+            if (lights [l].strength == 0) continue;
+            // a negative strength light exchanges shade and bright sides
+            uint32_t * const darker  = (lights [l].strength > 0) ? &shade : &bright;
+            uint32_t * const lighter = (lights [l].strength > 0) ? &bright : &shade;
+
+            const GPoint inner = translation_point (shadow_inner_translation [l][r]);
+            if (here && inner_z && bounds.origin.y <= y - inner.y && y - inner.y < y_end &&
+                bounds.origin.y <= y + inner.y && y + inner.y < y_end) {
+              fetch_planes (plus, y + inner.y, k, inner.x, words, bounds);
+              fetch_planes (minus, y - inner.y, k, - inner.x, words, bounds);
+              const uint32_t on_plus = codes_mask (plus, same_base [r]);
+              const uint32_t on_minus = codes_mask (minus, same_base [r]);
+              const int dx = (inner.x > 0) ? inner.x : - inner.x;
+              const uint32_t valid = here & column_mask (k, row->min_x + dx, row->max_x + 1 - dx);
+              // shadow side, then bright side of the object
+              *darker  |= valid & on_minus & ~ on_plus;
+              *lighter |= valid & ~ on_minus & on_plus;
+            }
+
+            const GPoint outer = translation_point (shadow_outer_translation [l][r]);
+            if (outer_z && under [r]) {
+              // pixels down the object, on a lower object
+              fetch_planes (minus, y - outer.y, k, - outer.x, words, bounds);
+              const uint32_t source = codes_mask (minus, (ShadowCodes) 1 << (r + 1));
+              if (source) {
+                *darker |= source & codes_mask (planes, under [r]);
+              }
+            }
+          }
+        }
+
+        // opposite lights cancel each other
+        const uint32_t darken = shade & ~ bright & columns & dither;
+        const uint32_t lighten = bright & ~ shade & columns & dither;
+        fb_row [k] = (fb_row [k] & ~ darken) | lighten;
+      }
+    }
+  } graphics_release_frame_buffer(ctx, fb);
+}
+
+GColor gcolor_shade (const GColor color, const int level) {
+  return (level < 0) ? GColorBlack : (level > 0) ? GColorWhite : color;
+}
+
+void capture_next_shadow (ShadowCaptureSink sink, void *context) {
+  APP_LOG (APP_LOG_LEVEL_WARNING, "Shadow capture is not available on black and white platforms");
+}
+
+bool replay_shadow_capture (GContext * const ctx, const uint8_t *capture, size_t length) {
+  return false;
+}
 #endif
 
-  ((GColor *) data) [row_beginning + row_x] = color;
-}
-
-GColor color_matrix [64][2]
-= {
-  /* GColorBlack                 ((uint8_t)0b11000000)y */  {GColorBlack, GColorDarkGray},
-  /* GColorOxfordBlue            ((uint8_t)0b11000001)y */  {GColorBlack, GColorDukeBlue},
-  /* GColorDukeBlue              ((uint8_t)0b11000010)y */  {GColorOxfordBlue, GColorBlue},
-  /* GColorBlue                  ((uint8_t)0b11000011)y */  {GColorDukeBlue, GColorBlueMoon},
-  /* GColorDarkGreen             ((uint8_t)0b11000100)y */  {GColorBlack, GColorMayGreen},
-  /* GColorMidnightGreen         ((uint8_t)0b11000101)y */  {GColorOxfordBlue, GColorCadetBlue},
-  /* GColorCobaltBlue            ((uint8_t)0b11000110)y */  {GColorDukeBlue, GColorVividCerulean},
-  /* GColorBlueMoon              ((uint8_t)0b11000111)y */  {GColorBlue, GColorPictonBlue},
-  /* GColorIslamicGreen          ((uint8_t)0b11001000)y */  {GColorDarkGreen, GColorGreen},
-  /* GColorJaegerGreen           ((uint8_t)0b11001001)y */  {GColorDarkGreen, GColorMalachite},
-  /* GColorTiffanyBlue           ((uint8_t)0b11001010)y */  {GColorMidnightGreen, GColorMediumSpringGreen},
-  /* GColorVividCerulean         ((uint8_t)0b11001011)y */  {GColorCobaltBlue, GColorCeleste},
-  /* GColorGreen                 ((uint8_t)0b11001100)y */  {GColorIslamicGreen, GColorInchworm},
-  /* GColorMalachite             ((uint8_t)0b11001101)y */  {GColorJaegerGreen, GColorMintGreen},
-  /* GColorMediumSpringGreen     ((uint8_t)0b11001110)y */  {GColorTiffanyBlue, GColorCeleste},
-  /* GColorCyan                  ((uint8_t)0b11001111)y */  {GColorBlue, GColorCeleste},
-  /* GColorBulgarianRose         ((uint8_t)0b11010000)y */  {GColorBlack, GColorDarkCandyAppleRed},
-  /* GColorImperialPurple        ((uint8_t)0b11010001)y */  {GColorBlack, GColorPurple},
-  /* GColorIndigo                ((uint8_t)0b11010010)y */  {GColorOxfordBlue, GColorVividViolet},
-  /* GColorElectricUltramarine   ((uint8_t)0b11010011)y */  {GColorOxfordBlue, GColorBabyBlueEyes},
-  /* GColorArmyGreen             ((uint8_t)0b11010100)y */  {GColorBlack, GColorBrass},
-  /* GColorDarkGray              ((uint8_t)0b11010101)y */  {GColorBlack, GColorLightGray},
-  /* GColorLiberty               ((uint8_t)0b11010110)y */  {GColorOxfordBlue, GColorBabyBlueEyes},
-  /* GColorVeryLightBlue         ((uint8_t)0b11010111)y */  {GColorDukeBlue, GColorBabyBlueEyes},
-  /* GColorKellyGreen            ((uint8_t)0b11011000)y */  {GColorDarkGreen, GColorSpringBud},
-  /* GColorMayGreen              ((uint8_t)0b11011001)y */  {GColorMidnightGreen, GColorMalachite},
-  /* GColorCadetBlue             ((uint8_t)0b11011010)y */  {GColorMidnightGreen, GColorMediumSpringGreen},
-  /* GColorPictonBlue            ((uint8_t)0b11011011)y */  {GColorCobaltBlue, GColorCeleste},
-  /* GColorBrightGreen           ((uint8_t)0b11011100)y */  {GColorKellyGreen, GColorMintGreen},
-  /* GColorScreaminGreen         ((uint8_t)0b11011101)y */  {GColorGreen, GColorMintGreen},
-  /* GColorMediumAquamarine      ((uint8_t)0b11011110)y */  {GColorJaegerGreen, GColorCeleste},
-  /* GColorElectricBlue          ((uint8_t)0b11011111)y */  {GColorTiffanyBlue, GColorCeleste},
-  /* GColorDarkCandyAppleRed     ((uint8_t)0b11100000)y */  {GColorBulgarianRose, GColorSunsetOrange},
-  /* GColorJazzberryJam          ((uint8_t)0b11100001)y */  {GColorImperialPurple, GColorMagenta},
-  /* GColorPurple                ((uint8_t)0b11100010)y */  {GColorImperialPurple, GColorShockingPink},
-  /* GColorVividViolet           ((uint8_t)0b11100011)y */  {GColorImperialPurple, GColorBabyBlueEyes},
-  /* GColorWindsorTan            ((uint8_t)0b11100100)y */  {GColorBlack, GColorRajah},
-  /* GColorRoseVale              ((uint8_t)0b11100101)y */  {GColorBulgarianRose, GColorMelon},
-  /* GColorPurpureus             ((uint8_t)0b11100110)y */  {GColorPurple, GColorRichBrilliantLavender},
-  /* GColorLavenderIndigo        ((uint8_t)0b11100111)y */  {GColorPurple, GColorRichBrilliantLavender},
-  /* GColorLimerick              ((uint8_t)0b11101000)y */  {GColorArmyGreen, GColorSpringBud},
-  /* GColorBrass                 ((uint8_t)0b11101001)y */  {GColorArmyGreen, GColorSpringBud},
-  /* GColorLightGray             ((uint8_t)0b11101010)y */  {GColorDarkGray, GColorWhite},
-  /* GColorBabyBlueEyes          ((uint8_t)0b11101011)y */  {GColorElectricUltramarine, GColorWhite},
-  /* GColorSpringBud             ((uint8_t)0b11101100)y */  {GColorKellyGreen, GColorWhite},
-  /* GColorInchworm              ((uint8_t)0b11101101)y */  {GColorSpringBud, GColorWhite},
-  /* GColorMintGreen             ((uint8_t)0b11101110)y */  {GColorScreaminGreen, GColorWhite},
-  /* GColorCeleste               ((uint8_t)0b11101111)y */  {GColorElectricBlue, GColorWhite},
-  /* GColorRed                   ((uint8_t)0b11110000)y */  {GColorDarkCandyAppleRed, GColorSunsetOrange},
-  /* GColorFolly                 ((uint8_t)0b11110001)y */  {GColorRoseVale, GColorBrilliantRose},
-  /* GColorFashionMagenta        ((uint8_t)0b11110010)y */  {GColorJazzberryJam, GColorBrilliantRose},
-  /* GColorMagenta               ((uint8_t)0b11110011)y */  {GColorJazzberryJam, GColorRichBrilliantLavender},
-  /* GColorOrange                ((uint8_t)0b11110100)y */  {GColorWindsorTan, GColorRajah},
-  /* GColorSunsetOrange          ((uint8_t)0b11110101)y */  {GColorRed, GColorMelon},
-  /* GColorBrilliantRose         ((uint8_t)0b11110110)y */  {GColorFashionMagenta, GColorRichBrilliantLavender},
-  /* GColorShockingPink          ((uint8_t)0b11110111)y */  {GColorJazzberryJam, GColorRichBrilliantLavender},
-  /* GColorChromeYellow          ((uint8_t)0b11111000)y */  {GColorWindsorTan, GColorYellow},
-  /* GColorRajah                 ((uint8_t)0b11111001)y */  {GColorChromeYellow, GColorIcterine},
-  /* GColorMelon                 ((uint8_t)0b11111010)y */  {GColorSunsetOrange, GColorWhite},
-  /* GColorRichBrilliantLavender ((uint8_t)0b11111011)y */  {GColorMagenta, GColorWhite},
-  /* GColorYellow                ((uint8_t)0b11111100)y */  {GColorChromeYellow, GColorYellow},
-  /* GColorIcterine              ((uint8_t)0b11111101)y */  {GColorYellow, GColorPastelYellow},
-  /* GColorPastelYellow          ((uint8_t)0b11111110)y */  {GColorIcterine, GColorWhite},
-  /* GColorWhite                 ((uint8_t)0b11111111)y */  {GColorLightGray, GColorWhite}
-};
+////////////////////////////////////////////////////////////////////////////////
+static inline const ShadowRow *shadow_row (const int y) {
+  return &shadow_rows [y - shadow_bitmap_bounds.origin.y];
+}
+static inline uint_t row_min_x (const uint_t y) {
+  return shadow_row (y)->min_x;
+}
+static inline uint_t row_max_x (const uint_t y) {
+  return shadow_row (y)->max_x;
+}
+static inline bool in_shadow_bounds (const GPoint point, const GRect bounds) {
+  return gpoint_in_rect (point, bounds) &&
+    row_min_x (point.y) <= (uint_t) point.x && (uint_t) point.x <= row_max_x (point.y);
+}
+static inline int pixel_index (const GPoint point, const GPoint translation) {
+  return shadow_row (point.y + translation.y)->offset + point.x + translation.x;
+}
+static inline GColor get_fb_pixel(const uint8_t *data, GPoint point, GPoint translation) {
+  return (GColor) (data [pixel_index (point, translation)]);
+}
 
-inline GColor get_light_shadow_color (const GColor c) {
-  return color_matrix [c.argb & 0b00111111][0];
+static inline void set_fb_pixel(uint8_t * const data, const GPoint point, const GPoint translation, const GColor color) {
+  ((GColor *) data) [pixel_index (point, translation)] = color;
 }
 
-GColor get_light_bright_color (const GColor c) {
-  return color_matrix [c.argb & 0b00111111][1];
+#if defined(PBL_COLOR)
+// generated by tools/shadow-lut.py, row (level + GShadowLevels) is directly indexed by argb
+extern const uint8_t shadow_color_lut [2 * GShadowLevels + 1][256];
+
+static inline GColor shade_color (const GColor c, const int level) {
+  return (GColor) {.argb = shadow_color_lut [level + GShadowLevels][c.argb]};
+}
+
+static inline int clamp_level (const int level) {
+  return (level < - GShadowLevels) ? - GShadowLevels : (level > GShadowLevels) ? GShadowLevels : level;
+}
+
+GColor gcolor_shade (const GColor color, const int level) {
+  return shade_color (color, clamp_level (level));
 }
 
 void test_shadow_layer_proc (Layer *layer, GContext *ctx) {
@@ -342,8 +1109,8 @@ void test_shadow_layer_proc (Layer *layer, GContext *ctx) {
     int x = i % 4; int y = i / 4;
     int w = bounds.size.w / 4; int h = bounds.size.h / (64 / 4);
     GColor c = (GColor){.argb = (0b11<<6)+i};
-    GColor r = get_light_shadow_color (c);
-    GColor s = get_light_bright_color (c);
+    GColor r = gcolor_shade (c, -1);
+    GColor s = gcolor_shade (c, 1);
     graphics_context_set_fill_color(ctx, r);
     graphics_fill_rect (ctx, GRect (x * w, y * h, w / 3, h), 0, GCornerNone);
     graphics_context_set_fill_color(ctx, c);
@@ -352,3 +1119,4 @@ void test_shadow_layer_proc (Layer *layer, GContext *ctx) {
     graphics_fill_rect (ctx, GRect (x * w + 2 * w / 3, y * h, w / 3, h), 0, GCornerNone);
   }
 }
+#endif
@@ -23,14 +23,49 @@ typedef struct ShadowBitmap ShadowBitmap;
 
 #define NW (((TRIG_MAX_ANGLE) * 3) / 8)
 
-typedef int8_t GShadow;
+// Object handle: low byte is the value drawn on objects map, high byte the generation of the
+// object slot, detecting use of released objects
+typedef uint16_t GShadow;
 #define GShadowClear     ((GShadow) 0b00000000)
 #define GShadowMaxRef    ((GShadow) 0b00111111)
-#define GShadowUnclear   (~ GShadowMaxRef)
+#define GShadowUnclear   ((GShadow) 0b11000000)
+#define GShadowGenerationShift 8
 #define GShadowMaxValue  10000
+#if defined(PBL_BW)
+// Black and white platforms: objects map is made of GShadowPlanes 1 – bit planes (plus one
+// scratch plane), holding up to (2^GShadowPlanes - 1) objects. GShadowPlanes (up to 5) may be
+// changed by a build wide definition only, libshadow.c and users having to agree on it.
+#ifndef GShadowPlanes
+#define GShadowPlanes    3
+#endif
+#define GShadowMaxObjects ((1 << GShadowPlanes) - 1)
+#else
+#define GShadowMaxObjects GShadowMaxRef
+#endif
 GColor gcolor (GShadow shadow);
 
+// Shade a color by level steps of perceptual lightness, from - GShadowLevels (darkest) to
+// + GShadowLevels (brightest), in a single table lookup (see tools/shadow-lut.py).
+#define GShadowLevels    4
+GColor gcolor_shade (const GColor color, const int level);
+
+// z values are stored on 8 bits (clamped with a warning). Return GShadowClear when all objects are in use.
 GShadow new_shadowing_object (const int base_z, const int inner_z, const int outer_z);
+// Released object is immediately reusable, and must not be drawn anymore (stale handles draw as clear).
+void release_shadowing_object (const GShadow shadow);
+
+// Optional caller – provided buffer (for instance allocated at window load), from which all shadow
+// state is carved instead of being allocated on heap on first use. Features select the optional
+// buffers to be reserved; shadow_buffer_size gives the needed length for this platform display.
+// On round displays, it is an upper bound (maps being counted as full squares, framebuffer rows
+// geometry being only known at first context switch): unused end of buffer is left untouched.
+typedef enum {
+  ShadowFeatureContinuous = 1 << 0, // distance map for ShadowShadingContinuous
+  ShadowFeatureMultiLight = 1 << 1  // light level map for create_shadow_multi with several lights
+} ShadowFeatures;
+size_t shadow_buffer_size (const uint32_t features);
+// Must be called before first shadow context switch, buffer being in use until destroy_shadow_ctx.
+bool shadow_init_with_buffer (void * const mem, const size_t length, const uint32_t features);
 
 void switch_to_shadow_ctx (GContext * const ctx);
 void revert_to_fb_ctx (GContext * const ctx);
@@ -39,4 +74,38 @@ void destroy_shadow_ctx ();
 void create_shadow (GContext * const ctx, const int32_t angle);
 void reset_shadow ();
 
+// Several lights in one pass over the objects map: each light shades by strength levels, light
+// levels being summed per pixel (on 4 bits, strengths being bounded to ± 7) then applied once
+// (see gcolor_shade). Strength may be negative; levels beyond ± GShadowLevels saturate.
+typedef struct {
+  int32_t angle;
+  int strength;
+} ShadowLight;
+#define ShadowMaxLights 4
+void create_shadow_multi (GContext * const ctx, const ShadowLight * const lights, size_t n);
+
+// Self shading mode: edge (default) samples the objects map at ± inner translation only,
+// continuous follows a distance transform of objects interior, giving bevel – like gradients.
+typedef enum {
+  ShadowShadingEdge,
+  ShadowShadingContinuous
+} ShadowShading;
+void set_shadow_shading (const ShadowShading shading);
+
+// Antialiased shading: translations are sub-sampled at 2x, the pixel past a shade band or a shadow
+// edge being shaded by half (dithered) when covered by half. Edge self shading and projective
+// shadows only; ignored on black and white platforms.
+void set_shadow_antialiased (const bool antialiased);
+
+// Frame capture: the inputs of the next shadow rendering (lights, shading modes, objects list, objects
+// map and framebuffer before shading) are streamed once to the sink, maps being run – length encoded.
+typedef void (*ShadowCaptureSink) (const uint8_t *data, size_t length, void *context);
+#define ShadowCaptureVersion 4
+void capture_next_shadow (ShadowCaptureSink sink, void *context);
+// Replay a capture on the given context (objects list, objects map and framebuffer are overwritten)
+// then call create_shadow_multi with the captured lights. Return false if capture does not match context.
+bool replay_shadow_capture (GContext * const ctx, const uint8_t *capture, size_t length);
+
+#if defined(PBL_COLOR)
 void test_shadow_layer_proc (Layer *layer, GContext *ctx);
+#endif
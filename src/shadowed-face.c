@@ -60,6 +60,7 @@ static GShadow minute_shadow;
 static GShadow hour_shadow;
 static GShadow dot_shadow;
 static GShadow hole_shadow, shadow_bg;
+static void *shadow_buffer;
 /*
  * Animation start
  */
@@ -283,6 +284,10 @@ static void window_load(Window *window) {
   layer_add_child(window_layer, background_layer);
   layer_add_child(background_layer, hands_layer);
 
+  // shadow state allocated once here, rather than on first rendering
+  shadow_buffer = malloc(shadow_buffer_size(0));
+  shadow_init_with_buffer(shadow_buffer, shadow_buffer_size(0), 0);
+
   shadow_bg = new_shadowing_object (0, 3, 0);
   hole_shadow = new_shadowing_object (-5, 0, 0);
   hour_shadow = new_shadowing_object (0, 2, 8);
@@ -296,7 +301,13 @@ static void window_load(Window *window) {
 static void window_unload(Window *window) {
   layer_destroy(background_layer);
   layer_destroy(hands_layer);
+  release_shadowing_object (shadow_bg);
+  release_shadowing_object (hole_shadow);
+  release_shadowing_object (hour_shadow);
+  release_shadowing_object (minute_shadow);
+  release_shadowing_object (dot_shadow);
   destroy_shadow_ctx ();
+  free(shadow_buffer);
 }
 
 /*
@@ -0,0 +1,124 @@
+#!/usr/bin/env python
+# Copyright (C): Baptiste Fouques 2016
+
+# This file is part of Shadow Library.
+
+# Shadow Library is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+
+# Shadow Library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU LesserGeneral Public License for more details.
+
+# You should have received a copy of the GNU Lesser General Public License
+# along with Shadow Library.  If not, see <http://www.gnu.org/licenses/>.
+
+"""Generate shadow color tables.
+
+Usage: shadow-lut.py libshadow.h output.c
+
+For every GColor8 value (256 entries, directly indexed by argb), and every
+level from -GShadowLevels (darkest) to +GShadowLevels (brightest), the table
+gives the nearest Pebble color whose perceptual lightness (OKLab) is moved
+linearly toward black (white), the last level being black (white), hue being
+kept as much as the 64 colors palette allows.
+
+Runs under Python 2 (the interpreter of the SDK build) as well as Python 3.
+"""
+
+from __future__ import division
+
+import re
+import sys
+
+# weight of chroma against lightness when looking for the nearest color, the
+# forced first level step being allowed a smaller hue drift
+CHROMA_WEIGHT = 4
+FIRST_LEVEL_CHROMA_WEIGHT = 64
+
+
+def srgb_to_linear(c):
+    c = c / 255.0
+    return c / 12.92 if c <= 0.04045 else ((c + 0.055) / 1.055) ** 2.4
+
+
+def oklab(rgb):
+    r, g, b = (srgb_to_linear(c) for c in rgb)
+    l = 0.4122214708 * r + 0.5363325363 * g + 0.0514459929 * b
+    m = 0.2119034982 * r + 0.6806995451 * g + 0.1073969566 * b
+    s = 0.0883024619 * r + 0.2817188376 * g + 0.6299787005 * b
+    l, m, s = (x ** (1.0 / 3.0) for x in (l, m, s))
+    return (0.2104542553 * l + 0.7936177850 * m - 0.0040720468 * s,
+            1.9779984951 * l - 2.4285922050 * m + 0.4505937099 * s,
+            0.0259040371 * l + 0.7827717662 * m - 0.8086757660 * s)
+
+
+def palette():
+    colors = []
+    for rgb6 in range(64):
+        rgb = tuple(((rgb6 >> shift) & 0b11) * 85 for shift in (4, 2, 0))
+        colors.append(oklab(rgb))
+    return colors
+
+
+def distance(a, b, chroma_weight):
+    return (a[0] - b[0]) ** 2 + chroma_weight * ((a[1] - b[1]) ** 2 + (a[2] - b[2]) ** 2)
+
+
+def shade(colors, rgb6, levels):
+    """Return shaded rgb6 values for level -levels .. +levels."""
+    origin = colors[rgb6]
+    result = {0: rgb6}
+    for direction in (-1, 1):
+        previous = rgb6
+        for k in range(1, levels + 1):
+            if direction < 0:
+                lightness = origin[0] * (1.0 - k / levels)
+                ratio = lightness / origin[0] if origin[0] else 0.0
+            else:
+                lightness = origin[0] + (1.0 - origin[0]) * k / levels
+                ratio = (1.0 - lightness) / (1.0 - origin[0]) if origin[0] < 1.0 else 0.0
+            # keep hue, chroma fading out toward black (white)
+            target = (lightness, origin[1] * ratio, origin[2] * ratio)
+
+            # levels are monotonic in lightness
+            candidates = [c for c in range(64)
+                          if direction * (colors[c][0] - colors[previous][0]) >= -1e-6]
+            best = min(candidates, key=lambda c: distance(colors[c], target, CHROMA_WEIGHT))
+            if k == 1 and best == rgb6:
+                # first level always changes color, when possible
+                strict = [c for c in candidates
+                          if direction * (colors[c][0] - colors[rgb6][0]) > 1e-6]
+                if strict:
+                    best = min(strict, key=lambda c: distance(colors[c], target, FIRST_LEVEL_CHROMA_WEIGHT))
+            previous = best
+            result[direction * k] = previous
+    return result
+
+
+def main(header, output):
+    with open(header) as f:
+        levels = int(re.search(r'#define\s+GShadowLevels\s+\(?(\d+)\)?', f.read()).group(1))
+
+    colors = palette()
+    shades = [shade(colors, rgb6, levels) for rgb6 in range(64)]
+
+    with open(output, 'w') as f:
+        f.write('/* Generated by tools/shadow-lut.py, do not edit. */\n\n')
+        f.write('#include <stdint.h>\n\n')
+        f.write('const uint8_t shadow_color_lut [{}][256] = {{\n'.format(2 * levels + 1))
+        for level in range(-levels, levels + 1):
+            f.write('  /* level {:+d} */\n  {{'.format(level))
+            for argb in range(256):
+                if argb % 16 == 0:
+                    f.write('\n   ')
+                f.write(' 0x{:02x},'.format((argb & 0b11000000) | shades[argb & 0b00111111][level]))
+            f.write('\n  },\n')
+        f.write('};\n')
+
+
+if __name__ == '__main__':
+    main(sys.argv[1], sys.argv[2])